@@ -1,7 +1,87 @@
+#include <stddef.h>
 #include <string.h>
 #include <debug.h>
 #include "hid.h"
 
+#ifndef HID_CACHE_ENTRIES
+#define HID_CACHE_ENTRIES 2
+#endif
+
+/* Layout of a previously initialized interface, for fast reconnects */
+typedef struct {
+    bool valid;
+    uint16_t vendor;
+    uint16_t product;
+    uint16_t release;
+    uint8_t interface;
+    uint8_t type;
+    uint8_t in_address;
+    uint8_t out_address;
+    uint8_t report_size;
+    hid_layout_t layout;
+    size_t config_length;
+    uint8_t config[256];
+} hid_cache_entry_t;
+
+static hid_cache_entry_t hid_cache[HID_CACHE_ENTRIES];
+static uint8_t hid_cache_next;
+
+#ifndef HID_MAX_REPORT_DESCRIPTOR_SIZE
+#define HID_MAX_REPORT_DESCRIPTOR_SIZE 512
+#endif
+
+#define HID_BOOT_REPORT_SIZE 8
+
+#define HID_DESCRIPTOR 0x21
+#define HID_REPORT_DESCRIPTOR 0x22
+
+#define HID_USAGE(page, id) (((uint32_t) (page) << 16) | (id))
+#define HID_PAGE_GENERIC_DESKTOP 0x01
+#define HID_PAGE_BUTTON 0x09
+#define HID_PAGE_DIGITIZER 0x0D
+
+/* Input item flags */
+#define HID_INPUT_CONSTANT (1 << 0)
+#define HID_INPUT_VARIABLE (1 << 1)
+#define HID_INPUT_RELATIVE (1 << 2)
+
+#define HID_MAX_USAGES 16
+#define HID_MAX_GLOBAL_STACK 2
+
+#define HID_DEFAULT_SCREEN_WIDTH 320
+#define HID_DEFAULT_SCREEN_HEIGHT 240
+
+/* A single value from an Input item, as seen by the report descriptor parser */
+typedef struct {
+    uint32_t application;
+    uint32_t usage;
+    uint8_t report_id;
+    uint8_t flags;
+    hid_field_t field;
+} hid_input_t;
+
+typedef void (*hid_input_handler_t)(const hid_input_t *input, void *data);
+
+typedef struct {
+    uint16_t usage_page;
+    int32_t logical_min;
+    int32_t logical_max;
+    uint32_t logical_max_raw;
+    uint8_t report_size;
+    uint16_t report_count;
+    uint8_t report_id;
+} hid_globals_t;
+
+typedef struct {
+    hid_pointer_t *pointer;
+    bool found_xy;
+} hid_pointer_parse_t;
+
+typedef struct {
+    hid_gamepad_t *gamepad;
+    bool found;
+} hid_gamepad_parse_t;
+
 /* Internal functions declaration */
 static usb_error_t
 hid_ReportCallback(usb_endpoint_t pEndpoint, usb_transfer_status_t status,
@@ -10,6 +90,83 @@ hid_ReportCallback(usb_endpoint_t pEndpoint, usb_transfer_status_t status,
 static bool
 hid_IsKeyDownInReport(hid_keyboard_report_t *report, uint8_t key_code);
 
+static void hid_SetKeyBit(hid_state_t *hid, uint8_t key_code, bool down);
+
+static void hid_MatchChords(hid_state_t *hid);
+
+static void hid_TransferError(hid_state_t *hid, usb_endpoint_t endpoint,
+                              usb_transfer_status_t status);
+
+static void hid_Rearm(hid_state_t *hid, usb_endpoint_t endpoint);
+
+static void hid_Backoff(hid_state_t *hid);
+
+static usb_error_t hid_RetryTimerCallback(usb_timer_t *timer);
+
+static hid_error_t hid_Start(hid_state_t *hid);
+
+static hid_error_t hid_InitReport(hid_state_t *hid, size_t length);
+
+static hid_error_t
+hid_ParseReportDescriptor(const uint8_t *desc, size_t length,
+                          hid_input_handler_t handler, void *data);
+
+static int24_t hid_ClampInt24(int32_t value);
+
+static int24_t hid_GetField(const uint8_t *report, const hid_field_t *field);
+
+static bool hid_GetBit(const uint8_t *report, uint16_t bit);
+
+static bool hid_IsPointerApplication(uint32_t application);
+
+static void hid_PointerInput(const hid_input_t *input, void *data);
+
+static void hid_PointerReport(hid_state_t *hid);
+
+static bool hid_IsGamepadApplication(uint32_t application);
+
+static void hid_GamepadInput(const hid_input_t *input, void *data);
+
+static void hid_GamepadReport(hid_state_t *hid);
+
+static uint32_t hid_ScaleField(const hid_field_t *field, uint24_t size);
+
+static uint24_t hid_MapField(const hid_field_t *field, int24_t value,
+                             uint32_t scale);
+
+static void hid_StartInactivityTimer(hid_state_t *hid);
+
+static usb_error_t hid_InactivityTimerCallback(usb_timer_t *timer);
+
+static void hid_Reactivate(hid_state_t *hid);
+
+static void hid_NoteInput(hid_state_t *hid);
+
+static void hid_StopTimers(hid_state_t *hid);
+
+static void hid_Teardown(hid_state_t *hid);
+
+static bool
+hid_IsConfigured(usb_device_t dev, const usb_configuration_descriptor_t *conf,
+                 size_t length);
+
+static hid_cache_entry_t *
+hid_FindCache(const usb_device_descriptor_t *dev_desc, uint8_t interface);
+
+static hid_error_t hid_LoadCache(hid_state_t *hid, hid_cache_entry_t *entry);
+
+static void
+hid_StoreCache(hid_state_t *hid, const usb_device_descriptor_t *dev_desc,
+               const usb_configuration_descriptor_t *conf,
+               size_t config_length);
+
+/* Delay before the second consecutive retry, doubled for each one after */
+#define HID_BACKOFF_MS 8
+#define HID_BACKOFF_MAX_SHIFT 7
+
+/* How often inactive time is checked against the inactivity timeout */
+#define HID_INACTIVITY_TICK_MS 100
+
 hid_error_t hid_SetProtocol(hid_state_t *hid, bool report);
 
 static usb_error_t
@@ -20,7 +177,7 @@ hid_ReportCallback(usb_endpoint_t pEndpoint, usb_transfer_status_t status,
         dbg_sprintf(dbgout, "callback called with status %u\n", status);
         if(status & USB_TRANSFER_NO_DEVICE) {
             hid->active = false;
-            hid->stopped = true;
+            hid_Teardown(hid);
             if(hid->callback)
                 hid->callback(hid, HID_EVENT_DISCONNECTED, 0,
                               hid->callback_data);
@@ -28,49 +185,81 @@ hid_ReportCallback(usb_endpoint_t pEndpoint, usb_transfer_status_t status,
         }
     }
     if(!hid->active) {
-        hid->stopped = true;
+        hid_Teardown(hid);
         return USB_SUCCESS;
     }
+    if(status) {
+        hid_TransferError(hid, pEndpoint, status);
+        return USB_SUCCESS;
+    }
+    hid->error_count = 0;
+
+    /* Repeated reports from the idle rate don't count as input, and
+     * gamepads only count changes that get past their filtering */
+    if(hid->type != HID_GAMEPAD &&
+       (memcmp(&hid->report, &hid->last_report, hid->report_size) ||
+        (hid->type == HID_MOUSE &&
+         (hid->report.mouse.x || hid->report.mouse.y))))
+        hid_NoteInput(hid);
+
     if(hid->type == HID_KEYBOARD) {
-        if(hid->callback) {
-            uint8_t i;
+        uint8_t i;
+        /* Chords only match as they are pressed, not as keys are released */
+        bool pressed = false;
 
-            /* Check for keydowns */
-            for(i = 0; i < sizeof(hid->report.kb.pressed); i++) {
-                uint8_t key = hid->report.kb.pressed[i];
-                if(!key || key == 1) continue;
-                if(!hid_IsKeyDownInReport(&hid->last_report.kb, key)) {
+        /* Check for keydowns */
+        for(i = 0; i < sizeof(hid->report.kb.pressed); i++) {
+            uint8_t key = hid->report.kb.pressed[i];
+            if(!key || key == 1) continue;
+            if(!hid_IsKeyDownInReport(&hid->last_report.kb, key)) {
+                hid_SetKeyBit(hid, key, true);
+                pressed = true;
+                if(hid->callback)
                     hid->callback(hid, HID_EVENT_KEY_DOWN, key,
                                   hid->callback_data);
-                }
             }
+        }
 
-            /* Check for keyups */
-            for(i = 0; i < sizeof(hid->last_report.kb.pressed); i++) {
-                uint8_t key = hid->last_report.kb.pressed[i];
-                if(!key) continue;
-                if(!hid_IsKeyDownInReport(&hid->report.kb, key)) {
+        /* Check for keyups */
+        for(i = 0; i < sizeof(hid->last_report.kb.pressed); i++) {
+            uint8_t key = hid->last_report.kb.pressed[i];
+            if(!key) continue;
+            if(!hid_IsKeyDownInReport(&hid->report.kb, key)) {
+                hid_SetKeyBit(hid, key, false);
+                if(hid->callback)
                     hid->callback(hid, HID_EVENT_KEY_UP, key,
                                   hid->callback_data);
-                }
             }
+        }
 
-            /* Check for modifiers */
-            for(i = 0; i < 8; i++) {
-                uint8_t mod = 1 << i;
-                if(hid->report.kb.modifiers & mod) {
-                    if(!(hid->last_report.kb.modifiers & mod)) {
-                        hid->callback(hid, HID_EVENT_MODIFIER_DOWN, mod,
-                                      hid->callback_data);
-                    }
-                } else {
-                    if(hid->last_report.kb.modifiers & mod) {
-                        hid->callback(hid, HID_EVENT_MODIFIER_UP, mod,
-                                      hid->callback_data);
+        /* Check for modifiers */
+        if(hid->report.kb.modifiers & ~hid->last_report.kb.modifiers)
+            pressed = true;
+        if(hid->report.kb.modifiers != hid->last_report.kb.modifiers) {
+            if(hid->callback) {
+                for(i = 0; i < 8; i++) {
+                    uint8_t mod = 1 << i;
+                    if(hid->report.kb.modifiers & mod) {
+                        if(!(hid->last_report.kb.modifiers & mod)) {
+                            hid->callback(hid, HID_EVENT_MODIFIER_DOWN, mod,
+                                          hid->callback_data);
+                        }
+                    } else {
+                        if(hid->last_report.kb.modifiers & mod) {
+                            hid->callback(hid, HID_EVENT_MODIFIER_UP, mod,
+                                          hid->callback_data);
+                        }
                     }
                 }
             }
         }
+
+        if(pressed && hid->num_chords)
+            hid_MatchChords(hid);
+    } else if(hid->type == HID_POINTER_ABSOLUTE) {
+        hid_PointerReport(hid);
+    } else if(hid->type == HID_GAMEPAD) {
+        hid_GamepadReport(hid);
     } else {
         uint8_t i;
         hid->delta_x += hid->report.mouse.x;
@@ -99,10 +288,90 @@ hid_ReportCallback(usb_endpoint_t pEndpoint, usb_transfer_status_t status,
         }
     }
 
-    memcpy(&hid->last_report, &hid->report, sizeof(hid->report));
+    memcpy(&hid->last_report, &hid->report, hid->report_size);
+
+    hid_Rearm(hid, pEndpoint);
+    return USB_SUCCESS;
+}
+
+static void hid_TransferError(hid_state_t *hid, usb_endpoint_t endpoint,
+                              usb_transfer_status_t status) {
+    /* The buffer may hold a partial report, so don't diff it */
+    memcpy(&hid->report, &hid->last_report, hid->report_size);
+
+    if(status & USB_TRANSFER_CANCELLED) {
+        /* Someone else tore down the endpoint, so there's nothing to re-arm */
+        hid->active = false;
+    } else if(status & USB_TRANSFER_STALLED) {
+        /* Clearing the halt blocks, so leave it to the retry timer */
+        hid->halted = true;
+    }
+
+    if(hid->callback)
+        hid->callback(hid, HID_EVENT_ERROR, status, hid->callback_data);
 
-    usb_ScheduleTransfer(pEndpoint, &hid->report, hid->report_size,
-                         (usb_transfer_callback_t) hid_ReportCallback, hid);
+    if(!hid->active) {
+        hid_Teardown(hid);
+        if(status & USB_TRANSFER_CANCELLED && hid->callback)
+            hid->callback(hid, HID_EVENT_DISCONNECTED, 0, hid->callback_data);
+        return;
+    }
+
+    /* Retry a one-off error right away, and back off if it keeps failing */
+    if(!hid->error_count && !hid->halted) {
+        hid->error_count = 1;
+        hid_Rearm(hid, endpoint);
+    } else {
+        hid_Backoff(hid);
+    }
+}
+
+static void hid_Rearm(hid_state_t *hid, usb_endpoint_t endpoint) {
+    usb_error_t error;
+
+    error = usb_ScheduleTransfer(endpoint, &hid->report, hid->report_size,
+                                 (usb_transfer_callback_t) hid_ReportCallback,
+                                 hid);
+    if(error) {
+        dbg_sprintf(dbgout, "error %u on reschedule\n", error);
+        hid_Backoff(hid);
+    }
+}
+
+static void hid_Backoff(hid_state_t *hid) {
+    uint8_t shift = hid->error_count ? hid->error_count - 1 : 0;
+
+    if(shift > HID_BACKOFF_MAX_SHIFT) shift = HID_BACKOFF_MAX_SHIFT;
+    if(hid->error_count <= HID_BACKOFF_MAX_SHIFT) hid->error_count++;
+
+    hid->retry_pending = true;
+    usb_StartTimerCycles(&hid->retry_timer,
+                         usb_MsToCycles((uint24_t)HID_BACKOFF_MS << shift));
+}
+
+static usb_error_t hid_RetryTimerCallback(usb_timer_t *timer) {
+    hid_state_t *hid = (hid_state_t *) ((uint8_t *) timer -
+                                        offsetof(hid_state_t, retry_timer));
+
+    hid->retry_pending = false;
+    if(!(usb_GetDeviceFlags(hid->dev) & USB_IS_ENABLED)) {
+        /* No transfer is pending to tell us about the disconnect */
+        hid->active = false;
+        hid_Teardown(hid);
+        if(hid->callback)
+            hid->callback(hid, HID_EVENT_DISCONNECTED, 0, hid->callback_data);
+        return USB_SUCCESS;
+    }
+    if(!hid->active) {
+        hid_Teardown(hid);
+        return USB_SUCCESS;
+    }
+    if(hid->halted) {
+        hid->halted = false;
+        if(usb_ClearEndpointHalt(hid->in))
+            dbg_sprintf(dbgout, "failed to clear halt\n");
+    }
+    hid_Rearm(hid, hid->in);
     return USB_SUCCESS;
 }
 
@@ -111,6 +380,8 @@ hid_ReportCallback(usb_endpoint_t pEndpoint, usb_transfer_status_t status,
 hid_error_t hid_Init(hid_state_t *hid, usb_device_t dev, uint8_t interface) {
     hid_error_t error;
     uint8_t config;
+    usb_device_descriptor_t dev_desc;
+    hid_cache_entry_t *cached;
     union {
         uint8_t bytes[256];
         usb_configuration_descriptor_t conf;
@@ -120,6 +391,8 @@ hid_error_t hid_Init(hid_state_t *hid, usb_device_t dev, uint8_t interface) {
     const usb_descriptor_t *search_pos, *end;
     bool interface_found = false;
     const usb_descriptor_t *next;
+    size_t report_desc_length = 0;
+    uint24_t in_packet_size = 0;
 
     hid->dev = dev;
     hid->active = false;
@@ -130,9 +403,24 @@ hid_error_t hid_Init(hid_state_t *hid, usb_device_t dev, uint8_t interface) {
     hid->type = 0;
     hid->callback = NULL;
     hid->callback_data = NULL;
+    hid->retry_timer.handler = hid_RetryTimerCallback;
+    hid->retry_pending = false;
+    hid->error_count = 0;
+    hid->halted = false;
+    hid->referenced = false;
+    hid->inactivity_timer.handler = hid_InactivityTimerCallback;
+    hid->inactivity_timer_pending = false;
+    hid->inactive = false;
+    hid->inactive_ms = 0;
+    hid->inactivity_timeout_ms = 0;
     hid->delta_x = 0;
     hid->delta_y = 0;
-    hid->report_size = sizeof(hid->report);
+    memset(&hid->layout, 0, sizeof(hid->layout));
+    hid->chords = NULL;
+    hid->num_chords = 0;
+    hid->num_keys = 0;
+    memset(hid->key_bits, 0, sizeof(hid->key_bits));
+    hid->report_size = HID_BOOT_REPORT_SIZE;
 
     if(!(usb_GetDeviceFlags(dev) & USB_IS_ENABLED)) {
         usb_ResetDevice(dev);
@@ -140,17 +428,33 @@ hid_error_t hid_Init(hid_state_t *hid, usb_device_t dev, uint8_t interface) {
         dbg_sprintf(dbgout, "reset device\n");
     }
 
-    RET_ERROR(usb_GetConfiguration(dev, &config));
-    dbg_sprintf(dbgout, "got config %u\n", config);
+    RET_ERROR(usb_GetDescriptor(dev, USB_DEVICE_DESCRIPTOR, 0, &dev_desc,
+                                sizeof(dev_desc), NULL));
 
-    if(config) {
+    /* Skip fetching and parsing the configuration for a known device */
+    cached = hid_FindCache(&dev_desc, interface);
+    if(cached && !hid_LoadCache(hid, cached)) {
+        dbg_sprintf(dbgout, "using cached config\n");
+        return hid_Start(hid);
+    }
+
+    if(dev_desc.bNumConfigurations == 1) {
+        /* The only configuration is set if its endpoints exist, so there's
+         * no need to ask the device */
         RET_ERROR(usb_GetDescriptor(dev, USB_CONFIGURATION_DESCRIPTOR,
-                                    config - 1, &conf_desc, 256, NULL));
-        config_length = conf_desc.conf.wTotalLength;
+                                    0, &conf_desc, 256, NULL));
+        config = hid_IsConfigured(dev, &conf_desc.conf, 256) ?
+                 conf_desc.conf.bConfigurationValue : 0;
     } else {
+        RET_ERROR(usb_GetConfiguration(dev, &config));
         RET_ERROR(usb_GetDescriptor(dev, USB_CONFIGURATION_DESCRIPTOR,
-                                    0, &conf_desc, 256, NULL));
-        config_length = conf_desc.conf.wTotalLength;
+                                    config ? config - 1 : 0, &conf_desc, 256,
+                                    NULL));
+    }
+    dbg_sprintf(dbgout, "got config %u\n", config);
+    config_length = conf_desc.conf.wTotalLength;
+
+    if(!config) {
         if(config_length > 256) {
             dbg_sprintf(dbgout, "config too long\n");
             return HID_ERROR_NO_MEMORY;
@@ -177,10 +481,20 @@ hid_error_t hid_Init(hid_state_t *hid, usb_device_t dev, uint8_t interface) {
                 if(desc->bInterfaceNumber != interface) break;
                 if(desc->bInterfaceClass != USB_HID_CLASS)
                     return HID_NO_INTERFACE;
-                if(desc->bInterfaceSubClass != HID_BOOT)
-                    return HID_NO_INTERFACE;
                 interface_found = true;
-                hid->type = desc->bInterfaceProtocol;
+                /* Anything else is identified from its report descriptor */
+                if(desc->bInterfaceSubClass == HID_BOOT &&
+                   (desc->bInterfaceProtocol == HID_KEYBOARD ||
+                    desc->bInterfaceProtocol == HID_MOUSE))
+                    hid->type = desc->bInterfaceProtocol;
+                break;
+            }
+
+            case HID_DESCRIPTOR: {
+                const uint8_t *desc = (const uint8_t *) search_pos;
+                if(!interface_found) break;
+                if(desc[0] >= 9 && desc[6] == HID_REPORT_DESCRIPTOR)
+                    report_desc_length = desc[7] | desc[8] << 8;
                 break;
             }
 
@@ -191,6 +505,7 @@ hid_error_t hid_Init(hid_state_t *hid, usb_device_t dev, uint8_t interface) {
                     /* IN endpoint */
                     hid->in = usb_GetDeviceEndpoint(dev,
                                                     desc->bEndpointAddress);
+                    in_packet_size = desc->wMaxPacketSize & 0x7FF;
                 } else {
                     /* OUT endpoint */
                     hid->out = usb_GetDeviceEndpoint(dev,
@@ -209,12 +524,44 @@ hid_error_t hid_Init(hid_state_t *hid, usb_device_t dev, uint8_t interface) {
 
     found:
 
+    if(!hid->type) {
+        /* Report protocol reports are up to a packet long */
+        if(!in_packet_size || in_packet_size > HID_MAX_REPORT_SIZE)
+            return HID_NO_INTERFACE;
+        hid->report_size = in_packet_size;
+        RET_ERROR(hid_InitReport(hid, report_desc_length));
+    }
+
+    RET_ERROR(hid_Start(hid));
+    hid_StoreCache(hid, &dev_desc, &conf_desc.conf, config_length);
+    return HID_SUCCESS;
+}
+
+/* Set the protocol and idle time, and start listening for reports */
+static hid_error_t hid_Start(hid_state_t *hid) {
+    hid_error_t error;
+
     memset(&hid->report, 0, sizeof(hid->report));
     memset(&hid->last_report, 0, sizeof(hid->last_report));
-    error = hid_SetProtocol(hid, 0);
-    if(error) {
-        dbg_sprintf(dbgout, "error %u on protocol set\n", error);
-        return error;
+    if(hid->type == HID_KEYBOARD || hid->type == HID_MOUSE) {
+        error = hid_SetProtocol(hid, 0);
+        if(error) {
+            dbg_sprintf(dbgout, "error %u on protocol set\n", error);
+            return error;
+        }
+    } else if(hid->type == HID_POINTER_ABSOLUTE) {
+        hid->layout.pointer.screen_x = 0;
+        hid->layout.pointer.screen_y = 0;
+        hid->layout.pointer.buttons = 0;
+        hid_PointerSetScreenSize(hid, HID_DEFAULT_SCREEN_WIDTH,
+                                 HID_DEFAULT_SCREEN_HEIGHT);
+    } else if(hid->type == HID_GAMEPAD) {
+        hid_gamepad_t *gamepad = &hid->layout.gamepad;
+        /* Make sure the first report gets decoded */
+        memset(&hid->last_report, 0xFF, sizeof(hid->last_report));
+        memset(gamepad->axis_values, 0, sizeof(gamepad->axis_values));
+        gamepad->buttons = 0;
+        gamepad->hat_value = HID_HAT_CENTERED;
     }
     hid_SetIdleTime(hid, 1);
     if(hid->in) {
@@ -227,18 +574,662 @@ hid_error_t hid_Init(hid_state_t *hid, usb_device_t dev, uint8_t interface) {
             return error;
         }
     }
+    /* Keep the device around until every teardown path has run */
+    if(!hid->referenced) {
+        usb_RefDevice(hid->dev);
+        hid->referenced = true;
+    }
     hid->active = true;
     hid->stopped = false;
     return HID_SUCCESS;
 }
 
+/* Check whether a configuration is set by looking for its first endpoint */
+static bool
+hid_IsConfigured(usb_device_t dev, const usb_configuration_descriptor_t *conf,
+                 size_t length) {
+    const uint8_t *pos = (const uint8_t *) conf;
+    const uint8_t *end;
+
+    if(length > conf->wTotalLength) length = conf->wTotalLength;
+    end = pos + length;
+
+    while(end - pos >= 2 && pos[0]) {
+        if(pos[1] == USB_ENDPOINT_DESCRIPTOR && end - pos >= 3)
+            return usb_GetDeviceEndpoint(dev, pos[2]) != NULL;
+        pos += pos[0];
+    }
+    return false;
+}
+
+static hid_cache_entry_t *
+hid_FindCache(const usb_device_descriptor_t *dev_desc, uint8_t interface) {
+    uint8_t i;
+
+    for(i = 0; i < HID_CACHE_ENTRIES; i++) {
+        hid_cache_entry_t *entry = &hid_cache[i];
+        if(!entry->valid) continue;
+        if(entry->vendor != dev_desc->idVendor) continue;
+        if(entry->product != dev_desc->idProduct) continue;
+        if(entry->release != dev_desc->bcdDevice) continue;
+        if(entry->interface != interface) continue;
+        return entry;
+    }
+    return NULL;
+}
+
+static hid_error_t hid_LoadCache(hid_state_t *hid, hid_cache_entry_t *entry) {
+    const usb_configuration_descriptor_t *conf =
+            (usb_configuration_descriptor_t *) entry->config;
+    hid_error_t error;
+
+    /* Another interface of the device may have set it up already */
+    if(!hid_IsConfigured(hid->dev, conf, entry->config_length)) {
+        error = (hid_error_t) usb_SetConfiguration(hid->dev, conf,
+                                                   entry->config_length);
+        if(error) {
+            dbg_sprintf(dbgout, "error %u on cached set config\n", error);
+            entry->valid = false;
+            return error;
+        }
+    }
+
+    hid->type = entry->type;
+    hid->report_size = entry->report_size;
+    /* Report protocol devices need their parsed report layout back */
+    if(hid->type >= HID_POINTER_ABSOLUTE)
+        hid->layout = entry->layout;
+    if(entry->in_address) {
+        hid->in = usb_GetDeviceEndpoint(hid->dev, entry->in_address);
+        if(!hid->in) goto stale;
+    }
+    if(entry->out_address) {
+        hid->out = usb_GetDeviceEndpoint(hid->dev, entry->out_address);
+        if(!hid->out) goto stale;
+    }
+    return HID_SUCCESS;
+
+    stale:
+    entry->valid = false;
+    hid->type = 0;
+    hid->report_size = HID_BOOT_REPORT_SIZE;
+    hid->in = hid->out = NULL;
+    return HID_ERROR_FAILED;
+}
+
+static void
+hid_StoreCache(hid_state_t *hid, const usb_device_descriptor_t *dev_desc,
+               const usb_configuration_descriptor_t *conf,
+               size_t config_length) {
+    hid_cache_entry_t *entry;
+
+    if(config_length > sizeof(entry->config)) return;
+
+    entry = hid_FindCache(dev_desc, hid->interface);
+    if(!entry) {
+        entry = &hid_cache[hid_cache_next];
+        hid_cache_next = (hid_cache_next + 1) % HID_CACHE_ENTRIES;
+    }
+
+    entry->valid = true;
+    entry->vendor = dev_desc->idVendor;
+    entry->product = dev_desc->idProduct;
+    entry->release = dev_desc->bcdDevice;
+    entry->interface = hid->interface;
+    entry->type = hid->type;
+    entry->report_size = hid->report_size;
+    entry->layout = hid->layout;
+    entry->in_address = hid->in ? usb_GetEndpointAddress(hid->in) : 0;
+    entry->out_address = hid->out ? usb_GetEndpointAddress(hid->out) : 0;
+    entry->config_length = config_length;
+    memcpy(entry->config, conf, config_length);
+}
+
+void hid_ClearCache(void) {
+    uint8_t i;
+    for(i = 0; i < HID_CACHE_ENTRIES; i++)
+        hid_cache[i].valid = false;
+}
+
+/* Fetch and parse the report descriptor of a report protocol interface */
+static hid_error_t hid_InitReport(hid_state_t *hid, size_t length) {
+    uint8_t desc[HID_MAX_REPORT_DESCRIPTOR_SIZE];
+    usb_control_setup_t setup = {0x81, 0x06, HID_REPORT_DESCRIPTOR << 8, 0, 0};
+    hid_pointer_parse_t pointer_parse;
+    hid_gamepad_parse_t gamepad_parse;
+    size_t transferred;
+    hid_error_t error;
+
+    if(!length) return HID_NO_INTERFACE;
+    if(length > sizeof(desc)) {
+        dbg_sprintf(dbgout, "report descriptor too long\n");
+        return HID_ERROR_NO_MEMORY;
+    }
+
+    setup.wIndex = hid->interface;
+    setup.wLength = length;
+    RET_ERROR(usb_DefaultControlTransfer(hid->dev, &setup, desc, 50,
+                                         &transferred));
+
+    /* First find the axes, then the buttons in the same report */
+    memset(&hid->layout.pointer, 0, sizeof(hid->layout.pointer));
+    pointer_parse.pointer = &hid->layout.pointer;
+    pointer_parse.found_xy = false;
+    RET_ERROR(hid_ParseReportDescriptor(desc, transferred, hid_PointerInput,
+                                        &pointer_parse));
+    if(hid->layout.pointer.x.size && hid->layout.pointer.y.size) {
+        pointer_parse.found_xy = true;
+        RET_ERROR(hid_ParseReportDescriptor(desc, transferred,
+                                            hid_PointerInput, &pointer_parse));
+        hid->type = HID_POINTER_ABSOLUTE;
+        dbg_sprintf(dbgout, "absolute pointer\n");
+        return HID_SUCCESS;
+    }
+
+    memset(&hid->layout.gamepad, 0, sizeof(hid->layout.gamepad));
+    gamepad_parse.gamepad = &hid->layout.gamepad;
+    gamepad_parse.found = false;
+    RET_ERROR(hid_ParseReportDescriptor(desc, transferred, hid_GamepadInput,
+                                        &gamepad_parse));
+    if(gamepad_parse.found) {
+        hid_gamepad_t *gamepad = &hid->layout.gamepad;
+        uint8_t i;
+        for(i = 0; i < HID_GAMEPAD_MAX_AXES; i++) {
+            gamepad->axis_scale[i] = hid_ScaleField(&gamepad->axes[i], 255);
+            gamepad->dead_zone[i] = HID_GAMEPAD_DEFAULT_DEAD_ZONE;
+            gamepad->hysteresis[i] = HID_GAMEPAD_DEFAULT_HYSTERESIS;
+        }
+        hid->type = HID_GAMEPAD;
+        dbg_sprintf(dbgout, "gamepad\n");
+        return HID_SUCCESS;
+    }
+
+    return HID_NO_INTERFACE;
+}
+
+/* Walk a report descriptor, passing each Input value to handler */
+static hid_error_t
+hid_ParseReportDescriptor(const uint8_t *desc, size_t length,
+                          hid_input_handler_t handler, void *data) {
+    const uint8_t *pos = desc;
+    const uint8_t *end = desc + length;
+    hid_globals_t globals;
+    hid_globals_t stack[HID_MAX_GLOBAL_STACK];
+    uint8_t stack_depth = 0;
+    uint32_t usages[HID_MAX_USAGES];
+    uint8_t num_usages = 0;
+    uint32_t usage_min = 0, usage_max = 0;
+    bool usage_range = false;
+    uint8_t collection_depth = 0;
+    /* Bits used so far in the current report.
+     * Devices list all items for a report ID together. */
+    uint16_t offset = 0;
+    hid_input_t input;
+
+    memset(&globals, 0, sizeof(globals));
+    input.application = 0;
+
+    while(pos < end) {
+        uint8_t prefix = *pos++;
+        uint8_t size = prefix & 3;
+        uint32_t value = 0;
+        int32_t svalue;
+        uint8_t i;
+
+        if(prefix == 0xFE) {
+            /* Long items aren't used by anything we handle */
+            if(end - pos < 2) return HID_ERROR_FAILED;
+            pos += 2 + pos[0];
+            continue;
+        }
+
+        if(size == 3) size = 4;
+        if(end - pos < size) return HID_ERROR_FAILED;
+        for(i = 0; i < size; i++)
+            value |= (uint32_t) pos[i] << (i * 8);
+        pos += size;
+
+        svalue = (int32_t) value;
+        if(size && size < 4 && (value & ((uint32_t) 1 << (size * 8 - 1))))
+            svalue = (int32_t) (value | ~(((uint32_t) 1 << (size * 8)) - 1));
+
+        switch(prefix & 0xFC) {
+            case 0x80: { /* Input */
+                uint16_t j;
+                int32_t max = globals.logical_max;
+
+                /* Lots of devices give an unsigned maximum */
+                if(max < globals.logical_min)
+                    max = (int32_t) globals.logical_max_raw;
+
+                input.report_id = globals.report_id;
+                input.flags = value;
+                input.field.size = globals.report_size;
+                input.field.is_signed = globals.logical_min < 0;
+                input.field.min = hid_ClampInt24(globals.logical_min);
+                input.field.max = hid_ClampInt24(max);
+
+                for(j = 0; j < globals.report_count; j++) {
+                    if(usage_range) {
+                        input.usage = usage_min + j;
+                        if(input.usage > usage_max) input.usage = usage_max;
+                    } else if(num_usages) {
+                        input.usage = usages[j < num_usages ? j : num_usages - 1];
+                    } else {
+                        input.usage = 0;
+                    }
+                    input.field.offset = offset;
+                    if(!(value & HID_INPUT_CONSTANT) && globals.report_size &&
+                       globals.report_size <= 24)
+                        handler(&input, data);
+                    offset += globals.report_size;
+                }
+                break;
+            }
+
+            case 0xA0: /* Collection */
+                if(value == 1 && !collection_depth)
+                    input.application = num_usages ? usages[0] : usage_min;
+                collection_depth++;
+                break;
+
+            case 0xC0: /* End Collection */
+                if(collection_depth && !--collection_depth)
+                    input.application = 0;
+                break;
+
+            case 0x04: /* Usage Page */
+                globals.usage_page = value;
+                break;
+
+            case 0x14: /* Logical Minimum */
+                globals.logical_min = svalue;
+                break;
+
+            case 0x24: /* Logical Maximum */
+                globals.logical_max = svalue;
+                globals.logical_max_raw = value;
+                break;
+
+            case 0x74: /* Report Size */
+                globals.report_size = value;
+                break;
+
+            case 0x84: /* Report ID */
+                if(value != globals.report_id)
+                    offset = 0;
+                globals.report_id = value;
+                break;
+
+            case 0x94: /* Report Count */
+                globals.report_count = value;
+                break;
+
+            case 0xA4: /* Push */
+                if(stack_depth == HID_MAX_GLOBAL_STACK)
+                    return HID_ERROR_NOT_SUPPORTED;
+                stack[stack_depth++] = globals;
+                break;
+
+            case 0xB4: /* Pop */
+                if(!stack_depth) return HID_ERROR_FAILED;
+                globals = stack[--stack_depth];
+                break;
+
+            case 0x08: /* Usage */
+                if(num_usages < HID_MAX_USAGES)
+                    usages[num_usages++] = size == 4 ? value :
+                            HID_USAGE(globals.usage_page, value);
+                break;
+
+            case 0x18: /* Usage Minimum */
+                usage_min = size == 4 ? value :
+                        HID_USAGE(globals.usage_page, value);
+                usage_range = true;
+                break;
+
+            case 0x28: /* Usage Maximum */
+                usage_max = size == 4 ? value :
+                        HID_USAGE(globals.usage_page, value);
+                usage_range = true;
+                break;
+
+            default:
+                break;
+        }
+
+        /* Local items only last until the next main item */
+        if(!(prefix & 0x0C)) {
+            num_usages = 0;
+            usage_min = usage_max = 0;
+            usage_range = false;
+        }
+    }
+
+    return HID_SUCCESS;
+}
+
+static int24_t hid_ClampInt24(int32_t value) {
+    if(value > 0x7FFFFF) return 0x7FFFFF;
+    if(value < -0x800000) return -0x800000;
+    return value;
+}
+
+static int24_t hid_GetField(const uint8_t *report, const hid_field_t *field) {
+    const uint8_t *pos = &report[field->offset >> 3];
+    uint8_t bytes = ((field->offset & 7) + field->size + 7) >> 3;
+    uint32_t value = 0;
+    uint8_t i;
+
+    for(i = 0; i < bytes; i++)
+        value |= (uint32_t) pos[i] << (i * 8);
+    value >>= field->offset & 7;
+    value &= ((uint32_t) 1 << field->size) - 1;
+
+    if(field->is_signed && (value & ((uint32_t) 1 << (field->size - 1))))
+        value |= ~(((uint32_t) 1 << field->size) - 1);
+    return (int24_t) (int32_t) value;
+}
+
+static bool hid_GetBit(const uint8_t *report, uint16_t bit) {
+    return report[bit >> 3] & (1 << (bit & 7));
+}
+
+static bool hid_IsPointerApplication(uint32_t application) {
+    switch(application) {
+        case HID_USAGE(HID_PAGE_GENERIC_DESKTOP, 0x01): /* Pointer */
+        case HID_USAGE(HID_PAGE_GENERIC_DESKTOP, 0x02): /* Mouse */
+        case HID_USAGE(HID_PAGE_DIGITIZER, 0x01):       /* Digitizer */
+        case HID_USAGE(HID_PAGE_DIGITIZER, 0x02):       /* Pen */
+        case HID_USAGE(HID_PAGE_DIGITIZER, 0x03):       /* Light Pen */
+        case HID_USAGE(HID_PAGE_DIGITIZER, 0x04):       /* Touch Screen */
+        case HID_USAGE(HID_PAGE_DIGITIZER, 0x05):       /* Touch Pad */
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void hid_PointerInput(const hid_input_t *input, void *data) {
+    hid_pointer_parse_t *parse = data;
+    hid_pointer_t *pointer = parse->pointer;
+    uint16_t bit = input->field.offset + 1;
+    int8_t button = -1;
+
+    if(!hid_IsPointerApplication(input->application)) return;
+    if(!(input->flags & HID_INPUT_VARIABLE)) return;
+    /* Must fit in the buffer, after the report ID */
+    if(input->field.offset + input->field.size >
+       (HID_MAX_REPORT_SIZE - (input->report_id != 0)) * 8) return;
+
+    if(!parse->found_xy) {
+        /* Take the first absolute X and Y, which is the first finger of a
+         * multi-touch screen */
+        if(input->flags & HID_INPUT_RELATIVE) return;
+        if(input->field.max <= input->field.min) return;
+        if(pointer->x.size && input->report_id != pointer->report_id) return;
+        if(input->usage == HID_USAGE(HID_PAGE_GENERIC_DESKTOP, 0x30) &&
+           !pointer->x.size) {
+            pointer->report_id = input->report_id;
+            pointer->x = input->field;
+        } else if(input->usage == HID_USAGE(HID_PAGE_GENERIC_DESKTOP, 0x31) &&
+                  pointer->x.size && !pointer->y.size) {
+            pointer->y = input->field;
+        }
+        return;
+    }
+
+    if(input->report_id != pointer->report_id) return;
+    if(input->field.size != 1) return;
+
+    switch(input->usage) {
+        case HID_USAGE(HID_PAGE_DIGITIZER, 0x32): /* In Range */
+            if(!pointer->in_range_bit) pointer->in_range_bit = bit;
+            return;
+        case HID_USAGE(HID_PAGE_DIGITIZER, 0x42): /* Tip Switch */
+            button = HID_MOUSE_LEFT;
+            break;
+        case HID_USAGE(HID_PAGE_DIGITIZER, 0x43): /* Secondary Tip Switch */
+        case HID_USAGE(HID_PAGE_DIGITIZER, 0x44): /* Barrel Switch */
+            button = HID_MOUSE_RIGHT;
+            break;
+        default:
+            if(input->usage >> 16 == HID_PAGE_BUTTON &&
+               (input->usage & 0xFFFF) &&
+               (input->usage & 0xFFFF) <= HID_POINTER_MAX_BUTTONS)
+                button = (input->usage & 0xFFFF) - 1;
+            break;
+    }
+
+    if(button >= 0 && !pointer->button_bits[button])
+        pointer->button_bits[button] = bit;
+}
+
+static void hid_PointerReport(hid_state_t *hid) {
+    hid_pointer_t *pointer = &hid->layout.pointer;
+    const uint8_t *report = hid->report.bytes;
+    uint8_t buttons = 0;
+    uint8_t changed;
+    uint8_t i;
+
+    if(pointer->report_id) {
+        if(*report++ != pointer->report_id) return;
+    }
+
+    if(!pointer->in_range_bit ||
+       hid_GetBit(report, pointer->in_range_bit - 1)) {
+        uint24_t x = hid_MapField(&pointer->x,
+                                  hid_GetField(report, &pointer->x),
+                                  pointer->scale_x);
+        uint24_t y = hid_MapField(&pointer->y,
+                                  hid_GetField(report, &pointer->y),
+                                  pointer->scale_y);
+
+        if(x != pointer->screen_x || y != pointer->screen_y) {
+            pointer->screen_x = x;
+            pointer->screen_y = y;
+            if(hid->callback)
+                hid->callback(hid, HID_EVENT_POINTER_MOVE, 0,
+                              hid->callback_data);
+        }
+    }
+
+    for(i = 0; i < HID_POINTER_MAX_BUTTONS; i++) {
+        uint16_t bit = pointer->button_bits[i];
+        if(bit && hid_GetBit(report, bit - 1))
+            buttons |= 1 << i;
+    }
+
+    changed = buttons ^ pointer->buttons;
+    pointer->buttons = buttons;
+    if(!changed || !hid->callback) return;
+
+    for(i = 0; i < HID_POINTER_MAX_BUTTONS; i++) {
+        uint8_t button = 1 << i;
+        if(!(changed & button)) continue;
+        hid->callback(hid, buttons & button ? HID_EVENT_MOUSE_DOWN :
+                      HID_EVENT_MOUSE_UP, i, hid->callback_data);
+    }
+}
+
+static bool hid_IsGamepadApplication(uint32_t application) {
+    switch(application) {
+        case HID_USAGE(HID_PAGE_GENERIC_DESKTOP, 0x04): /* Joystick */
+        case HID_USAGE(HID_PAGE_GENERIC_DESKTOP, 0x05): /* Gamepad */
+        case HID_USAGE(HID_PAGE_GENERIC_DESKTOP, 0x08): /* Multi-axis Controller */
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void hid_GamepadInput(const hid_input_t *input, void *data) {
+    hid_gamepad_parse_t *parse = data;
+    hid_gamepad_t *gamepad = parse->gamepad;
+    uint16_t usage = input->usage & 0xFFFF;
+
+    if(!hid_IsGamepadApplication(input->application)) return;
+    if(!(input->flags & HID_INPUT_VARIABLE)) return;
+    if(input->field.offset + input->field.size >
+       (HID_MAX_REPORT_SIZE - (input->report_id != 0)) * 8) return;
+    /* Everything has to come from the same report */
+    if(parse->found && input->report_id != gamepad->report_id) return;
+
+    if(input->usage >> 16 == HID_PAGE_GENERIC_DESKTOP &&
+       usage >= 0x30 && usage < 0x30 + HID_GAMEPAD_MAX_AXES) {
+        /* X, Y, Z, Rx, Ry, Rz, Slider and Dial, in that order */
+        hid_field_t *axis = &gamepad->axes[usage - 0x30];
+        if(axis->size || input->field.max <= input->field.min) return;
+        *axis = input->field;
+    } else if(input->usage == HID_USAGE(HID_PAGE_GENERIC_DESKTOP, 0x39)) {
+        /* Hat switch */
+        int24_t positions = input->field.max - input->field.min + 1;
+        if(gamepad->hat.size) return;
+        if(positions == 8) gamepad->hat_shift = 0;
+        else if(positions == 4) gamepad->hat_shift = 1;
+        else return;
+        gamepad->hat = input->field;
+    } else if(input->usage >> 16 == HID_PAGE_BUTTON && usage) {
+        /* Buttons are read as one run of bits starting at button 1 */
+        if(input->field.size != 1) return;
+        if(usage != gamepad->num_buttons + 1) return;
+        if(gamepad->num_buttons == HID_GAMEPAD_MAX_BUTTONS) return;
+        if(gamepad->num_buttons &&
+           input->field.offset != gamepad->button_offset + gamepad->num_buttons)
+            return;
+        if(!gamepad->num_buttons) gamepad->button_offset = input->field.offset;
+        gamepad->num_buttons++;
+    } else {
+        return;
+    }
+
+    gamepad->report_id = input->report_id;
+    parse->found = true;
+}
+
+static void hid_GamepadReport(hid_state_t *hid) {
+    hid_gamepad_t *gamepad = &hid->layout.gamepad;
+    const uint8_t *report = hid->report.bytes;
+    uint24_t buttons = 0;
+    uint24_t changed;
+    uint8_t i;
+
+    /* Nothing can have changed, so skip decoding */
+    if(!memcmp(&hid->report, &hid->last_report, hid->report_size)) return;
+
+    if(gamepad->report_id) {
+        if(*report++ != gamepad->report_id) return;
+    }
+
+    for(i = 0; i < HID_GAMEPAD_MAX_AXES; i++) {
+        const hid_field_t *axis = &gamepad->axes[i];
+        int8_t value;
+
+        if(!axis->size) continue;
+        value = (int24_t) hid_MapField(axis, hid_GetField(report, axis),
+                                       gamepad->axis_scale[i]) - 127;
+        if(value <= (int8_t) gamepad->dead_zone[i] &&
+           value >= -(int8_t) gamepad->dead_zone[i])
+            value = 0;
+        if(value == gamepad->axis_values[i]) continue;
+        /* Ignore jitter, but always let the axis settle at center or an end */
+        if(value && value != 127 && value != -127) {
+            int24_t delta = (int24_t) value - gamepad->axis_values[i];
+            if(delta <= gamepad->hysteresis[i] &&
+               delta >= -(int24_t) gamepad->hysteresis[i])
+                continue;
+        }
+
+        gamepad->axis_values[i] = value;
+        hid_NoteInput(hid);
+        if(hid->callback)
+            hid->callback(hid, HID_EVENT_GAMEPAD_AXIS, i, hid->callback_data);
+    }
+
+    if(gamepad->hat.size) {
+        int24_t value = hid_GetField(report, &gamepad->hat);
+        uint8_t hat = HID_HAT_CENTERED;
+
+        /* Out of range is the null state */
+        if(value >= gamepad->hat.min && value <= gamepad->hat.max)
+            hat = (value - gamepad->hat.min) << gamepad->hat_shift;
+        if(hat != gamepad->hat_value) {
+            gamepad->hat_value = hat;
+            hid_NoteInput(hid);
+            if(hid->callback)
+                hid->callback(hid, HID_EVENT_GAMEPAD_HAT, hat,
+                              hid->callback_data);
+        }
+    }
+
+    for(i = 0; i < gamepad->num_buttons; i++) {
+        if(hid_GetBit(report, gamepad->button_offset + i))
+            buttons |= (uint24_t) 1 << i;
+    }
+
+    changed = buttons ^ gamepad->buttons;
+    gamepad->buttons = buttons;
+    if(!changed) return;
+    hid_NoteInput(hid);
+    if(!hid->callback) return;
+
+    for(i = 0; i < gamepad->num_buttons; i++) {
+        uint24_t button = (uint24_t) 1 << i;
+        if(!(changed & button)) continue;
+        hid->callback(hid, buttons & button ? HID_EVENT_GAMEPAD_DOWN :
+                      HID_EVENT_GAMEPAD_UP, i, hid->callback_data);
+    }
+}
+
+/* Fixed point output steps per logical unit, so that mapping a report
+ * doesn't need a division */
+static uint32_t hid_ScaleField(const hid_field_t *field, uint24_t size) {
+    uint32_t range = (uint32_t) ((int32_t) field->max - field->min) + 1;
+    return ((uint32_t) size << 16) / range;
+}
+
+static uint24_t hid_MapField(const hid_field_t *field, int24_t value,
+                             uint32_t scale) {
+    if(value < field->min) value = field->min;
+    if(value > field->max) value = field->max;
+    return ((uint32_t) (value - field->min) * scale) >> 16;
+}
+
 void hid_Stop(hid_state_t *hid) {
-    if(!hid->active) return;
-    hid->stopped = false;
+    /* With a retry pending, there's no transfer to wait for */
+    bool waiting = hid->active && !hid->retry_pending;
+
+    hid_StopTimers(hid);
     hid->active = false;
+    if(!waiting) {
+        hid_Teardown(hid);
+        return;
+    }
+    hid->stopped = false;
     while(!hid->stopped) usb_WaitForEvents();
 }
 
+/* Nothing may fire on hid once it has been torn down */
+static void hid_Teardown(hid_state_t *hid) {
+    hid->stopped = true;
+    hid_StopTimers(hid);
+    if(hid->referenced) {
+        usb_UnrefDevice(hid->dev);
+        hid->referenced = false;
+    }
+}
+
+static void hid_StopTimers(hid_state_t *hid) {
+    if(hid->retry_pending) {
+        usb_StopTimer(&hid->retry_timer);
+        hid->retry_pending = false;
+    }
+    if(hid->inactivity_timer_pending) {
+        usb_StopTimer(&hid->inactivity_timer);
+        hid->inactivity_timer_pending = false;
+    }
+}
+
 hid_error_t hid_SetProtocol(hid_state_t *hid, bool report) {
     usb_control_setup_t setup = {0x21, 0x0B, 0, 0, 0};
     setup.wIndex = hid->interface;
@@ -253,13 +1244,80 @@ hid_error_t hid_SetIdleTime(hid_state_t *hid, uint24_t time) {
     setup.wIndex = hid->interface;
 
     if(time >= 1024) time = 1023;
-    time &= 0x03FD;
+    /* Duration in 4 ms units goes in the high byte, report ID 0 in the low */
+    time &= 0x03FC;
     setup.wValue = time << 6;
 
     return (hid_error_t) usb_DefaultControlTransfer(hid->dev, &setup, NULL, 50,
                                                     NULL);
 }
 
+hid_error_t hid_SetInactivityTimeout(hid_state_t *hid, uint24_t timeout_ms) {
+    if(!hid->active) return HID_ERROR_INVALID_PARAM;
+
+    hid->inactivity_timeout_ms = timeout_ms;
+    hid->inactive_ms = 0;
+
+    if(hid->inactive)
+        hid_Reactivate(hid);
+
+    if(timeout_ms) {
+        hid_StartInactivityTimer(hid);
+    } else if(hid->inactivity_timer_pending) {
+        usb_StopTimer(&hid->inactivity_timer);
+        hid->inactivity_timer_pending = false;
+    }
+    return HID_SUCCESS;
+}
+
+static void hid_StartInactivityTimer(hid_state_t *hid) {
+    if(hid->inactivity_timer_pending) return;
+    hid->inactivity_timer_pending = true;
+    usb_StartTimerCycles(&hid->inactivity_timer,
+                         usb_MsToCycles(HID_INACTIVITY_TICK_MS));
+}
+
+static usb_error_t hid_InactivityTimerCallback(usb_timer_t *timer) {
+    hid_state_t *hid = (hid_state_t *) ((uint8_t *) timer -
+                                offsetof(hid_state_t, inactivity_timer));
+
+    if(!hid->active) {
+        hid->inactivity_timer_pending = false;
+        return USB_SUCCESS;
+    }
+
+    hid->inactive_ms += HID_INACTIVITY_TICK_MS;
+
+    if(hid->inactive_ms >= hid->inactivity_timeout_ms) {
+        dbg_sprintf(dbgout, "device inactive\n");
+        hid->inactive = true;
+        /* Nothing left to do until the next report with new input */
+        hid->inactivity_timer_pending = false;
+        if(hid->callback)
+            hid->callback(hid, HID_EVENT_INACTIVE, 0, hid->callback_data);
+        return USB_SUCCESS;
+    }
+
+    usb_RepeatTimerCycles(timer, usb_MsToCycles(HID_INACTIVITY_TICK_MS));
+    return USB_SUCCESS;
+}
+
+/* Called when input shows up, before its events are sent */
+static void hid_NoteInput(hid_state_t *hid) {
+    hid->inactive_ms = 0;
+    if(hid->inactive)
+        hid_Reactivate(hid);
+}
+
+static void hid_Reactivate(hid_state_t *hid) {
+    dbg_sprintf(dbgout, "device active\n");
+    hid->inactive = false;
+    if(hid->inactivity_timeout_ms)
+        hid_StartInactivityTimer(hid);
+    if(hid->callback)
+        hid->callback(hid, HID_EVENT_ACTIVE, 0, hid->callback_data);
+}
+
 static bool
 hid_IsKeyDownInReport(hid_keyboard_report_t *report, uint8_t key_code) {
     uint8_t i;
@@ -270,6 +1328,37 @@ hid_IsKeyDownInReport(hid_keyboard_report_t *report, uint8_t key_code) {
     return false;
 }
 
+/* Keep the bitset of held keys in sync with the reports, for chord matching */
+static void hid_SetKeyBit(hid_state_t *hid, uint8_t key_code, bool down) {
+    uint8_t *byte = &hid->key_bits[key_code >> 3];
+    uint8_t bit = 1 << (key_code & 7);
+
+    if(down) {
+        if(*byte & bit) return;
+        *byte |= bit;
+        hid->num_keys++;
+    } else {
+        if(!(*byte & bit)) return;
+        *byte &= ~bit;
+        hid->num_keys--;
+    }
+}
+
+static void hid_MatchChords(hid_state_t *hid) {
+    const hid_compiled_chord_t *chord = hid->chords;
+    uint8_t i;
+
+    for(i = 0; i < hid->num_chords; i++, chord++) {
+        /* Reject on the modifier mask and key count before the bitset */
+        if(chord->modifiers != hid->report.kb.modifiers) continue;
+        if(chord->num_keys != hid->num_keys) continue;
+        if(memcmp(chord->keys, hid->key_bits, sizeof(hid->key_bits))) continue;
+        if(hid->callback)
+            hid->callback(hid, HID_EVENT_CHORD, chord->id, hid->callback_data);
+        return;
+    }
+}
+
 bool hid_KbdIsKeyDown(hid_state_t *hid, uint8_t key_code) {
     uint8_t i;
     if(hid->type != HID_KEYBOARD) return false;
@@ -295,12 +1384,127 @@ hid_error_t hid_KbdSetLEDs(hid_state_t *hid, uint8_t leds) {
     }
 }
 
+hid_error_t hid_KbdSetChords(hid_state_t *hid, hid_compiled_chord_t *table,
+                             const hid_chord_t *chords, uint8_t num_chords) {
+    uint8_t i, j;
+    if(hid->type != HID_KEYBOARD) return HID_ERROR_NOT_SUPPORTED;
+    if(num_chords && (!table || !chords)) return HID_ERROR_INVALID_PARAM;
+
+    /* Check everything first, so a bad chord leaves the old ones working */
+    for(i = 0; i < num_chords; i++) {
+        bool empty = !chords[i].modifiers;
+        for(j = 0; j < HID_CHORD_MAX_KEYS; j++) {
+            uint8_t key = chords[i].keys[j];
+            if(!key) break;
+            /* Error codes and modifier keys never show up as held keys */
+            if(key == 1 || key >= 0xE0) return HID_ERROR_INVALID_PARAM;
+            empty = false;
+        }
+        if(empty) return HID_ERROR_INVALID_PARAM;
+    }
+
+    /* Don't match against a half-compiled table */
+    hid->num_chords = 0;
+
+    for(i = 0; i < num_chords; i++) {
+        hid_compiled_chord_t *entry = &table[i];
+        memset(entry, 0, sizeof(*entry));
+        entry->id = chords[i].id;
+        entry->modifiers = chords[i].modifiers;
+        for(j = 0; j < HID_CHORD_MAX_KEYS; j++) {
+            uint8_t key = chords[i].keys[j];
+            uint8_t bit = 1 << (key & 7);
+            if(!key) break;
+            if(entry->keys[key >> 3] & bit) continue;
+            entry->keys[key >> 3] |= bit;
+            entry->num_keys++;
+        }
+    }
+
+    hid->chords = table;
+    hid->num_chords = num_chords;
+    return HID_SUCCESS;
+}
+
 bool hid_MouseIsButtonDown(hid_state_t *hid, hid_mouse_button_t button) {
+    if(hid->type == HID_POINTER_ABSOLUTE)
+        return hid->layout.pointer.buttons & (1 << button);
     if(hid->type != HID_MOUSE) return false;
 
     return hid->report.mouse.buttons & (1 << button);
 }
 
+hid_error_t hid_PointerSetScreenSize(hid_state_t *hid, uint24_t width,
+                                     uint24_t height) {
+    hid_pointer_t *pointer = &hid->layout.pointer;
+
+    if(hid->type != HID_POINTER_ABSOLUTE) return HID_ERROR_NOT_SUPPORTED;
+    if(!width || !height || width > 0xFFFF || height > 0xFFFF)
+        return HID_ERROR_INVALID_PARAM;
+
+    pointer->scale_x = hid_ScaleField(&pointer->x, width);
+    pointer->scale_y = hid_ScaleField(&pointer->y, height);
+    return HID_SUCCESS;
+}
+
+void hid_PointerGetPosition(hid_state_t *hid, uint24_t *x, uint24_t *y) {
+    *x = hid->layout.pointer.screen_x;
+    *y = hid->layout.pointer.screen_y;
+}
+
+int8_t hid_GamepadGetAxis(hid_state_t *hid, hid_gamepad_axis_t axis) {
+    if(hid->type != HID_GAMEPAD || axis >= HID_GAMEPAD_MAX_AXES) return 0;
+
+    return hid->layout.gamepad.axis_values[axis];
+}
+
+bool hid_GamepadIsButtonDown(hid_state_t *hid, uint8_t button) {
+    if(hid->type != HID_GAMEPAD || button >= HID_GAMEPAD_MAX_BUTTONS)
+        return false;
+
+    return hid->layout.gamepad.buttons & ((uint24_t) 1 << button);
+}
+
+hid_gamepad_hat_t hid_GamepadGetHat(hid_state_t *hid) {
+    if(hid->type != HID_GAMEPAD) return HID_HAT_CENTERED;
+
+    return (hid_gamepad_hat_t) hid->layout.gamepad.hat_value;
+}
+
+hid_error_t hid_GamepadSetDeadZone(hid_state_t *hid, hid_gamepad_axis_t axis,
+                                   uint8_t dead_zone) {
+    hid_gamepad_t *gamepad = &hid->layout.gamepad;
+
+    if(hid->type != HID_GAMEPAD) return HID_ERROR_NOT_SUPPORTED;
+    if(dead_zone > 127) return HID_ERROR_INVALID_PARAM;
+
+    if(axis == HID_GAMEPAD_ALL_AXES) {
+        memset(gamepad->dead_zone, dead_zone, sizeof(gamepad->dead_zone));
+    } else if(axis < HID_GAMEPAD_MAX_AXES) {
+        gamepad->dead_zone[axis] = dead_zone;
+    } else {
+        return HID_ERROR_INVALID_PARAM;
+    }
+    return HID_SUCCESS;
+}
+
+hid_error_t hid_GamepadSetHysteresis(hid_state_t *hid, hid_gamepad_axis_t axis,
+                                     uint8_t threshold) {
+    hid_gamepad_t *gamepad = &hid->layout.gamepad;
+
+    if(hid->type != HID_GAMEPAD) return HID_ERROR_NOT_SUPPORTED;
+    if(threshold > 127) return HID_ERROR_INVALID_PARAM;
+
+    if(axis == HID_GAMEPAD_ALL_AXES) {
+        memset(gamepad->hysteresis, threshold, sizeof(gamepad->hysteresis));
+    } else if(axis < HID_GAMEPAD_MAX_AXES) {
+        gamepad->hysteresis[axis] = threshold;
+    } else {
+        return HID_ERROR_INVALID_PARAM;
+    }
+    return HID_SUCCESS;
+}
+
 void hid_MouseGetDeltas(hid_state_t *hid, int24_t *x, int24_t *y) {
     *x = hid->delta_x;
     *y = hid->delta_y;
@@ -31,7 +31,9 @@ typedef enum {
 typedef enum {
     HID_NONE     = 0,
     HID_KEYBOARD = 1,
-    HID_MOUSE    = 2
+    HID_MOUSE    = 2,
+    HID_POINTER_ABSOLUTE = 3,
+    HID_GAMEPAD  = 4
 } hid_device_type_t;
 
 enum {
@@ -65,11 +67,95 @@ typedef struct {
     int8_t y;
 } hid_mouse_report_t;
 
+#define HID_MAX_REPORT_SIZE 64
+
 typedef union {
     hid_keyboard_report_t kb;
     hid_mouse_report_t mouse;
+    uint8_t bytes[HID_MAX_REPORT_SIZE];
 } hid_report_t;
 
+/**
+ * Location of a value in a report-protocol report
+ */
+typedef struct {
+    uint16_t offset;    /**< Bit offset, not counting the report ID */
+    uint8_t size;       /**< Size in bits, or 0 if there is no such field */
+    bool is_signed;
+    int24_t min;        /**< Logical minimum */
+    int24_t max;        /**< Logical maximum */
+} hid_field_t;
+
+#define HID_POINTER_MAX_BUTTONS 5
+
+/**
+ * Layout and state of an absolute pointer, such as a touchscreen or tablet
+ */
+typedef struct {
+    uint8_t report_id;
+    hid_field_t x;
+    hid_field_t y;
+    uint16_t in_range_bit;                          /**< Bit offset + 1, or 0 */
+    uint16_t button_bits[HID_POINTER_MAX_BUTTONS];  /**< Bit offset + 1, or 0 */
+    uint32_t scale_x;       /**< Screen pixels per logical unit, 16.16 */
+    uint32_t scale_y;
+    uint24_t screen_x;
+    uint24_t screen_y;
+    uint8_t buttons;
+} hid_pointer_t;
+
+typedef enum {
+    HID_GAMEPAD_X,
+    HID_GAMEPAD_Y,
+    HID_GAMEPAD_Z,
+    HID_GAMEPAD_RX,
+    HID_GAMEPAD_RY,
+    HID_GAMEPAD_RZ,
+    HID_GAMEPAD_SLIDER,
+    HID_GAMEPAD_DIAL,
+    HID_GAMEPAD_MAX_AXES,
+    HID_GAMEPAD_ALL_AXES = 0xFF
+} hid_gamepad_axis_t;
+
+typedef enum {
+    HID_HAT_UP,
+    HID_HAT_UP_RIGHT,
+    HID_HAT_RIGHT,
+    HID_HAT_DOWN_RIGHT,
+    HID_HAT_DOWN,
+    HID_HAT_DOWN_LEFT,
+    HID_HAT_LEFT,
+    HID_HAT_UP_LEFT,
+    HID_HAT_CENTERED
+} hid_gamepad_hat_t;
+
+#define HID_GAMEPAD_MAX_BUTTONS 24
+#define HID_GAMEPAD_DEFAULT_DEAD_ZONE 12
+#define HID_GAMEPAD_DEFAULT_HYSTERESIS 2
+
+/**
+ * Layout and state of a gamepad or joystick
+ */
+typedef struct {
+    uint8_t report_id;
+    hid_field_t axes[HID_GAMEPAD_MAX_AXES];
+    uint32_t axis_scale[HID_GAMEPAD_MAX_AXES];  /**< Steps per logical unit, 16.16 */
+    uint8_t dead_zone[HID_GAMEPAD_MAX_AXES];
+    uint8_t hysteresis[HID_GAMEPAD_MAX_AXES];
+    int8_t axis_values[HID_GAMEPAD_MAX_AXES];   /**< -127 to 127 */
+    uint16_t button_offset;
+    uint8_t num_buttons;
+    uint24_t buttons;
+    hid_field_t hat;
+    uint8_t hat_shift;      /**< 1 for 4-way hats, 0 for 8-way */
+    uint8_t hat_value;
+} hid_gamepad_t;
+
+typedef union {
+    hid_pointer_t pointer;
+    hid_gamepad_t gamepad;
+} hid_layout_t;
+
 typedef enum {
     HID_EVENT_KEY_DOWN,
     HID_EVENT_KEY_UP,
@@ -79,15 +165,53 @@ typedef enum {
     HID_EVENT_MOUSE_UP,
     HID_EVENT_MOUSE_MOVE,
 
-    HID_EVENT_DISCONNECTED
+    HID_EVENT_DISCONNECTED,
+
+    HID_EVENT_CHORD,
+    HID_EVENT_ERROR,
+    HID_EVENT_INACTIVE,
+    HID_EVENT_ACTIVE,
+    HID_EVENT_POINTER_MOVE,
+    HID_EVENT_GAMEPAD_AXIS,
+    HID_EVENT_GAMEPAD_DOWN,
+    HID_EVENT_GAMEPAD_UP,
+    HID_EVENT_GAMEPAD_HAT
 } hid_event_t;
 
+#define HID_CHORD_MAX_KEYS 6
+
+/**
+ * A keyboard shortcut, such as Ctrl+S or Ctrl+Shift+Esc
+ * @note Modifiers must match exactly, so Ctrl+S using the left and right
+ * Ctrl keys are two different chords.
+ */
+typedef struct {
+    uint8_t id;                         /**< Passed as the code of HID_EVENT_CHORD */
+    uint8_t modifiers;                  /**< Modifier bitmap (KEY_MOD_*) */
+    uint8_t keys[HID_CHORD_MAX_KEYS];   /**< Key codes, terminated by 0 if not full */
+} hid_chord_t;
+
+/**
+ * Chord compiled into a modifier mask and a key bitset.
+ * Filled in by \c hid_KbdSetChords.
+ */
+typedef struct {
+    uint8_t id;
+    uint8_t modifiers;
+    uint8_t num_keys;
+    uint8_t keys[32];
+} hid_compiled_chord_t;
+
 typedef struct HID_State hid_state_t;
 
 /**
  * Type of the function to be called when a HID event occurs
  * @param event Event type
- * @param code Key code, modifier code, or mouse button
+ * @param code Key code, modifier code, mouse or gamepad button, gamepad
+ * axis or hat direction, chord id, or
+ * \c usb_transfer_status_t flags for HID_EVENT_ERROR
+ * @note A cancelled transfer stops the interface, so HID_EVENT_ERROR with
+ * USB_TRANSFER_CANCELLED is followed by HID_EVENT_DISCONNECTED.
  * @param callback_data Opaque pointer passed to \c hid_SetEventCallback
  */
 typedef void (*hid_callback_t)(hid_state_t *hid, hid_event_t event,
@@ -106,6 +230,21 @@ struct HID_State {
     hid_report_t last_report;
     int24_t delta_x;
     int24_t delta_y;
+    hid_layout_t layout;
+    usb_timer_t retry_timer;
+    bool retry_pending;
+    uint8_t error_count;
+    bool halted;
+    bool referenced;
+    usb_timer_t inactivity_timer;
+    bool inactivity_timer_pending;
+    bool inactive;
+    uint24_t inactive_ms;
+    uint24_t inactivity_timeout_ms;
+    const hid_compiled_chord_t *chords;
+    uint8_t num_chords;
+    uint8_t num_keys;
+    uint8_t key_bits[32];
     hid_callback_t callback;
     void *callback_data;
 };
@@ -120,9 +259,19 @@ struct HID_State {
  */
 hid_error_t hid_Init(hid_state_t *hid, usb_device_t dev, uint8_t interface);
 
+/**
+ * Forget the descriptors cached by \c hid_Init.
+ * @note \c hid_Init remembers the layout of the last few interfaces it set
+ * up, keyed on vendor ID, product ID and device release, so that a device
+ * that is plugged back in can skip fetching and parsing its configuration.
+ */
+void hid_ClearCache(void);
+
 /**
  * Stop listening on an HID interface
- * @note Call before freeing \c hid
+ * @note Call before freeing \c hid or passing it to \c hid_Init again
+ * @note \c hid holds a reference to its device while listening, which is
+ * released here or when the device is disconnected.
  */
 void hid_Stop(hid_state_t *hid);
 
@@ -135,6 +284,18 @@ void hid_Stop(hid_state_t *hid);
  */
 hid_error_t hid_SetIdleTime(hid_state_t *hid, uint24_t time);
 
+/**
+ * Get notified when a device hasn't sent any input for a while.
+ * After \p timeout_ms without input, HID_EVENT_INACTIVE is sent. The next
+ * report with new input sends HID_EVENT_ACTIVE before its own events.
+ * @note Nothing is done to the device itself, so the event handler can
+ * decide whether to dim the screen, power down, and so on.
+ * @param timeout_ms Time without input before HID_EVENT_INACTIVE, or 0 to
+ * never send it
+ * @return HID_SUCCESS if the timeout was set
+ */
+hid_error_t hid_SetInactivityTimeout(hid_state_t *hid, uint24_t timeout_ms);
+
 /**
  * Check if a key is down
  * @param key_code Key to check
@@ -157,7 +318,23 @@ bool hid_KbdIsModifierDown(hid_state_t *hid, uint8_t modifier);
 hid_error_t hid_KbdSetLEDs(hid_state_t *hid, hid_leds_t leds);
 
 /**
- * Check if a mouse button is down
+ * Set the chords that trigger HID_EVENT_CHORD.
+ * The event fires once when a key or modifier is pressed and the set of
+ * keys and modifiers held down becomes exactly equal to that of a chord.
+ * Releasing keys never triggers a chord.
+ * @param table Storage for \p num_chords compiled chords, which must stay
+ * valid until the chords are replaced or \c hid is stopped
+ * @param chords Chords to compile
+ * @param num_chords Number of chords, or 0 to disable chord matching
+ * @return HID_SUCCESS if the chords were set. On failure, \p table and the
+ * chords already in use are left unchanged.
+ */
+hid_error_t hid_KbdSetChords(hid_state_t *hid, hid_compiled_chord_t *table,
+                             const hid_chord_t *chords, uint8_t num_chords);
+
+/**
+ * Check if a mouse or absolute pointer button is down
+ * @note The tip switch of a touchscreen or pen counts as the left button.
  * @param button Button to check
  * @return true if button is down, false otherwise
  */
@@ -171,6 +348,66 @@ bool hid_MouseIsButtonDown(hid_state_t *hid, hid_mouse_button_t button);
  */
 void hid_MouseGetDeltas(hid_state_t *hid, int24_t *x, int24_t *y);
 
+/**
+ * Set the screen area that an absolute pointer maps onto.
+ * Defaults to 320x240 when the interface is initialized.
+ * @param width Screen width in pixels
+ * @param height Screen height in pixels
+ * @return HID_SUCCESS if the size was set
+ */
+hid_error_t hid_PointerSetScreenSize(hid_state_t *hid, uint24_t width,
+                                     uint24_t height);
+
+/**
+ * Get the screen position of an absolute pointer
+ * @param x Returns the x position
+ * @param y Returns the y position
+ */
+void hid_PointerGetPosition(hid_state_t *hid, uint24_t *x, uint24_t *y);
+
+/**
+ * Get the position of a gamepad axis, after dead zone filtering
+ * @param axis Axis to get
+ * @return Position from -127 to 127, or 0 if there is no such axis
+ */
+int8_t hid_GamepadGetAxis(hid_state_t *hid, hid_gamepad_axis_t axis);
+
+/**
+ * Check if a gamepad button is down
+ * @param button Button number, starting from 0
+ * @return true if button is down, false otherwise
+ */
+bool hid_GamepadIsButtonDown(hid_state_t *hid, uint8_t button);
+
+/**
+ * Get the direction of the gamepad's hat switch (D-pad)
+ * @return Direction, or HID_HAT_CENTERED if not pressed or missing
+ */
+hid_gamepad_hat_t hid_GamepadGetHat(hid_state_t *hid);
+
+/**
+ * Set the dead zone around the center of a gamepad axis.
+ * Positions within the dead zone read as 0, and moving within it doesn't
+ * cause HID_EVENT_GAMEPAD_AXIS.
+ * @param axis Axis to set, or HID_GAMEPAD_ALL_AXES
+ * @param dead_zone Dead zone, from 0 to 127
+ * @return HID_SUCCESS if the dead zone was set
+ */
+hid_error_t hid_GamepadSetDeadZone(hid_state_t *hid, hid_gamepad_axis_t axis,
+                                   uint8_t dead_zone);
+
+/**
+ * Set how far a gamepad axis has to move before it's reported.
+ * Changes of up to \p threshold from the last reported position are
+ * ignored, so that noise doesn't cause a stream of HID_EVENT_GAMEPAD_AXIS.
+ * Reaching the center or either end of the axis is always reported.
+ * @param axis Axis to set, or HID_GAMEPAD_ALL_AXES
+ * @param threshold Largest ignored change, from 0 to 127
+ * @return HID_SUCCESS if the threshold was set
+ */
+hid_error_t hid_GamepadSetHysteresis(hid_state_t *hid, hid_gamepad_axis_t axis,
+                                     uint8_t threshold);
+
 /**
  * Set the HID event handler function for an interface
  * @param callback Event handler function